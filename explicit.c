@@ -7,16 +7,27 @@
 
 
 #include "./allocator.h"
+#include "./explicit.h"
 #include "./debug_break.h"
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/mman.h>
 
 
 #define BYTES_PER_LINE 32
 #define MINIMUM_BLOCK_SIZE 24
 #define MINIMUM_PAYLOAD_SIZE 16
-#define ZERO_LAST 0xFFFFFFFFFFFFFFFE
+#define ZERO_FLAGS 0xFFFFFFFFFFFFFFF8
+#define SLACK 2   // Free block held as tail slack for the growing block just before it
+#define GROWN 4   // Allocated block that myrealloc has grown before
+#define HOT 2   // Allocated block placed as hot; shares its bit with SLACK, which only free blocks use
+#define HUGE_PAGE_SIZE (2UL << 20)
+#define MAX_REGIONS 512   // Hot bytes are counted per 2 MiB region for the first GiB; the rest share the last counter
+#define LARGE_REQUEST_SIZE 4096
+#define SIZE_CLASSES 9   // Power-of-two classes of small payloads: up to 16, 32, ... 4096 bytes
+#define HOT_REUSE_COUNT 16
+#define PLACEMENT_CANDIDATES 16
 
 typedef size_t header_t;
 
@@ -24,7 +35,12 @@ size_t segment_size;
 void *segment_start;
 void *segment_end;
 struct node* fl_front;
+struct node* fl_back;
 size_t nused;
+bool realloc_slack = true;   // Reserve geometric tail slack when a block keeps growing
+bool hot_cold_placement;   // Pack hot small blocks into the fullest huge pages, cold ones into the emptiest
+size_t region_hot[MAX_REGIONS];   // Hot payload bytes per 2 MiB region, counted where each header sits
+size_t class_mallocs[SIZE_CLASSES];   // Mallocs seen per small size class
 struct node {
     header_t* prev; 
     header_t* next;
@@ -40,9 +56,14 @@ void set_header(header_t *header, size_t size, int status) {
     *header = (size |= status);
 }
 
-// Given a pointer to a header, returns the payload size by zeroing out the last bit
+// Given a pointer to a free block header, returns true if the block is slack reserved by myrealloc
+bool is_slack(header_t *header) {
+    return (*header & SLACK) != 0;
+}
+
+// Given a pointer to a header, returns the payload size by zeroing out the flag bits
 size_t get_payload_size(header_t *header) {
-    return ((*header) & ZERO_LAST);  
+    return ((*header) & ZERO_FLAGS);  
 }
 
 // Given a pointer to a header, returns a pointer to the start of the block payload
@@ -104,6 +125,7 @@ header_t* next_free(header_t* header) {
 void add_free_block(struct node *new_free_payload) {
     if (!fl_front) {   // The list is currently empty (No free blocks)
         set_nodes(new_free_payload, NULL, NULL);
+        fl_back = new_free_payload;
     } else {
         fl_front->prev = payload2header(new_free_payload); 
         set_nodes(new_free_payload, NULL, payload2header(fl_front));
@@ -111,6 +133,20 @@ void add_free_block(struct node *new_free_payload) {
     fl_front = new_free_payload;  
 }
 
+/* Given a pointer to the payload of a free block we're adding, 
+ * adds the given block to the back of the explicit list. Hot/cold placement puts freed cold blocks
+ * here, so hot requests walking from the front meet the free blocks of hot regions first. 
+ */
+void append_free_block(struct node *new_free_payload) {
+    if (!fl_front) {
+        add_free_block(new_free_payload);
+        return;
+    }
+    fl_back->next = payload2header(new_free_payload);
+    set_nodes(new_free_payload, payload2header(fl_back), NULL);
+    fl_back = new_free_payload;
+}
+
 /* Given a pointer to the payload of a block we're removing, 
  * detaches the given block from its place in the explicit list by rewiring surrounding pointers.
  */
@@ -118,6 +154,7 @@ void detach_free_block(struct node *free_payload) {
     if (fl_front == free_payload) {   // Edge case 1: I'm removing from the front of the list
         if (!free_payload->next) {   // Edge case 2: I'm removing the only block in the list
             fl_front = NULL;
+            fl_back = NULL;
             return;
         } else {
             fl_front = header2payload(free_payload->next);
@@ -128,9 +165,11 @@ void detach_free_block(struct node *free_payload) {
         struct node *last_node = header2payload(last_free);
         last_node->next = free_payload->next;
     }
-    if (free_payload->next) {   // Edge case 3: I'm removing from the BACK of the list
+    if (free_payload->next) {   
         struct node* next_node = header2payload(free_payload->next);
         next_node->prev = free_payload->prev;
+    } else {   // Edge case 3: I'm removing from the BACK of the list
+        fl_back = header2payload(free_payload->prev);
     }
     set_nodes(free_payload, NULL, NULL);
 }
@@ -151,17 +190,167 @@ header_t* next_free_block(header_t* free_block_ptr) {
 
 /* Given the needed payload size, iterates over the explicit list of free blocks
  * until finding a block with an appropriately sized payload (first fit), and returns
- * a pointer to the header of the block. 
+ * a pointer to the header of the block. Realloc slack is passed over, and only handed out
+ * when nothing else fits. 
  */
 header_t *find_first(size_t needed) {
-    header_t *header = payload2header(fl_front); 
+    header_t *slack = NULL;
+    header_t *header = fl_front ? payload2header(fl_front) : NULL; 
     while (header != NULL) { 
         if (needed <= get_payload_size(header)) {
-            return header;
+            if (!is_slack(header)) {
+                return header;
+            }
+            slack = slack ? slack : header;
         }
         header = next_free(header);
     }
-    return NULL;  // We could not find an adequately sized payload
+    return slack;  // NULL if we could not find an adequately sized payload
+}
+
+// Merges two blocks into one block by removing one from the free list and updating the header of the original, keeping its flags
+void merge_blocks(header_t* new_free_block, size_t payload2merge) {
+    size_t orig_payloadsz = get_payload_size(new_free_block);  
+    size_t new_payloadsz = orig_payloadsz + payload2merge;
+    set_header(new_free_block, new_payloadsz, *new_free_block & ~ZERO_FLAGS);
+}
+
+/* Given a pointer to a free block, continuously determines if its right neighbor is free,
+ * and if so, merges them into a single free block.
+ */
+void coalesce(header_t* new_free_block) {
+    size_t payload2merge = 0;
+    header_t* right_neighbor = next_header(new_free_block);
+    while (right_neighbor) {
+        if (!is_free(right_neighbor)) {
+            break;
+        }
+        payload2merge += (ALIGNMENT + get_payload_size(right_neighbor));
+        struct node* right_nnode = header2payload(right_neighbor);
+        detach_free_block(right_nnode);
+        nused -= ALIGNMENT;
+        right_neighbor = next_header(right_neighbor);;
+    }
+    if (payload2merge > 0) {
+        merge_blocks(new_free_block, payload2merge);
+    }
+}
+
+// Given a pointer to a header, returns the hot byte counter of the 2 MiB region the header sits in
+size_t *region_of(header_t *header) {
+    size_t region = ((char *)header - (char *)segment_start) / HUGE_PAGE_SIZE;
+    return &region_hot[(region < MAX_REGIONS) ? region : MAX_REGIONS - 1];
+}
+
+/* Given the needed payload size, counts a malloc of its size class and returns true if the request
+ * is hot: small, and of a class that has been asked for at least HOT_REUSE_COUNT times. Anything else
+ * (large blocks, or small classes that rarely come around) is treated as cold and long-lived.
+ */
+bool count_hot_request(size_t needed) {
+    if (needed >= LARGE_REQUEST_SIZE) {
+        return false;
+    }
+    int class = 0;
+    while (((size_t)MINIMUM_PAYLOAD_SIZE << class) < needed) {
+        class++;
+    }
+    class_mallocs[class]++;
+    return class_mallocs[class] >= HOT_REUSE_COUNT;
+}
+
+// Given a pointer to an allocated block's header, stops counting it as hot in its region if it was
+void drop_hot(header_t *header) {
+    if (*header & HOT) {
+        *region_of(header) -= get_payload_size(header);
+        set_header(header, get_payload_size(header), *header & ~ZERO_FLAGS & ~HOT);
+    }
+}
+
+// Given a free block and the needed payload size, returns where a cold block carved from its tail would start
+header_t *tail_header(header_t *header, size_t needed) {
+    return (header_t *)((char *)header2payload(header) + get_payload_size(header) - needed - ALIGNMENT);
+}
+
+/* Given the needed payload size and whether the request is hot, walks the explicit list (hot requests
+ * from the front, cold ones from the back) until it has seen PLACEMENT_CANDIDATES fitting free blocks,
+ * and returns a pointer to the header of the best one, or NULL if none fit. Hot requests want the fit
+ * whose 2 MiB region holds the most hot bytes, cold ones the fit whose tail lands in the region holding
+ * the fewest. Each free block is coalesced with its free right neighbors as the walk passes, which is
+ * how a cold block carved from a tail rejoins the free block in front of it once freed. Realloc slack
+ * is only handed out when no other block fits.
+ */
+header_t *find_placed(size_t needed, bool hot) {
+    header_t *best = NULL;
+    size_t best_used = 0;
+    header_t *slack = NULL;
+    int candidates = 0;
+    struct node *start = hot ? fl_front : fl_back;
+    header_t *header = start ? payload2header(start) : NULL;
+    while (header != NULL && candidates < PLACEMENT_CANDIDATES) {
+        if (is_slack(header)) {
+            slack = (!slack && needed <= get_payload_size(header)) ? header : slack;
+        } else {
+            coalesce(header);
+            if (best > header && (char *)best < (char *)header2payload(header) + get_payload_size(header)) {
+                best = NULL;   // We just merged our best fit into this block, which fits too
+                candidates--;
+            }
+            if (needed <= get_payload_size(header)) {
+                candidates++;
+                size_t used = hot ? *region_of(header) : *region_of(tail_header(header, needed));
+                if (!best || (hot ? used > best_used : used < best_used)) {
+                    best = header;
+                    best_used = used;
+                }
+            }
+        }
+        header = hot ? next_free(header) : prev_free(header);
+    }
+    return best ? best : slack;
+}
+
+/* Lets clients turn hot/cold placement on or off. When on, hot requests (small, frequently reused
+ * size classes) are packed into the 2 MiB regions already holding the most hot bytes, and cold ones
+ * (large or rare) are carved from the tail of a fit in the region holding the fewest. Freed cold blocks
+ * go to the back of the explicit list, where cold requests start looking. Off by default.
+ */
+void set_hot_cold_placement(bool enabled) {
+    hot_cold_placement = enabled;
+}
+
+/* Given the size of the heap the client wants, maps a segment of at least that many bytes 
+ * aligned to a 2 MiB boundary and asks the kernel to back it with transparent huge pages.
+ * The result can be handed straight to myinit. Returns NULL for a zero or unmappably large size,
+ * or if the mapping fails; the madvise is only a hint, so a kernel without THP still gets 
+ * a usable (aligned) segment.
+ */
+void *hugepage_segment(size_t heap_size) {
+    if (heap_size == 0 || heap_size > (size_t)-1 - 2 * HUGE_PAGE_SIZE) {   // roundup would wrap
+        return NULL;
+    }
+    size_t segment_bytes = roundup(heap_size, HUGE_PAGE_SIZE);
+    size_t mapped = segment_bytes + HUGE_PAGE_SIZE;   // Over-map so we can trim to alignment
+    char *raw = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    char *aligned = (char *)roundup((size_t)raw, HUGE_PAGE_SIZE);
+    size_t lead = aligned - raw;
+    if (lead > 0) {
+        munmap(raw, lead);
+    }
+    munmap(aligned + segment_bytes, mapped - lead - segment_bytes);
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, segment_bytes, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+// Given a segment from hugepage_segment and the heap size it was requested with, unmaps it
+void release_hugepage_segment(void *segment, size_t heap_size) {
+    if (segment != NULL) {
+        munmap(segment, roundup(heap_size, HUGE_PAGE_SIZE));
+    }
 }
 
 /* Myinit initalizes the allocator by setting global variables and verifying
@@ -182,8 +371,11 @@ bool myinit(void *heap_start, size_t heap_size) {
     segment_end = (char *)heap_start + heap_size;
     set_header(segment_start, segment_size - ALIGNMENT, 0);
     fl_front = header2payload(segment_start);
+    fl_back = fl_front;
     set_nodes(fl_front, NULL, NULL);
-    nused += ALIGNMENT; 
+    memset(region_hot, 0, sizeof(region_hot));
+    memset(class_mallocs, 0, sizeof(class_mallocs));
+    nused = ALIGNMENT; 
     return true;
 }
 
@@ -221,6 +413,38 @@ bool big_enough(size_t remaining) {
     return false;
 }
 
+/* Given the needed payload size and whether the request is hot, places the block with find_placed.
+ * Hot blocks are split off the front of their fit like any other; cold blocks are carved from the tail, 
+ * so the front of the free block keeps its header and its place in the explicit list, and only its
+ * size changes. Returns a pointer to the new payload, or NULL if nothing fits.
+ */
+void *malloc_placed(size_t needed, bool hot) {
+    header_t *header = find_placed(needed, hot);
+    if (!header) {
+        return NULL;
+    }
+    size_t payloadsz = get_payload_size(header);
+    size_t remaining = payloadsz - needed;
+    if (big_enough(remaining) || hot) {
+        struct node* payload = header2payload(header);
+        detach_free_block(payload);
+        if (big_enough(remaining)) {
+            needed = payloadsz;   // Taking everything;
+        } else {
+            split_block(payload, needed, remaining);
+        }
+        set_header(header, needed, hot ? (1 | HOT) : 1);
+        nused += needed;
+        *region_of(header) += hot ? needed : 0;
+        return payload;
+    }
+    header_t *cold_header = tail_header(header, needed);
+    set_header(header, remaining - ALIGNMENT, 0);
+    set_header(cold_header, needed, 1);
+    nused += ALIGNMENT + needed;
+    return header2payload(cold_header);
+}
+
 /* Simulates the "malloc" function for our explicit heap allocator. The general procedure is as follows:
  * for a given needed size, iterate over the explicit list until we find the first sufficiently 
  * sized payload, then remove that block from the free list. If large enough, split the block 
@@ -233,6 +457,9 @@ void *mymalloc(size_t requested_size) {
     if (!validate_request(requested_size, needed)) {
         return NULL;
     }
+    if (hot_cold_placement) {
+        return malloc_placed(needed, count_hot_request(needed));
+    }
     header_t *header = find_first(needed); 
     if (!header) {
         return NULL; 
@@ -253,34 +480,6 @@ void *mymalloc(size_t requested_size) {
     return payload;
 }
 
-// Merges two free blocks into one block by removing one from the free list and updating the header of the original
-void merge_blocks(header_t* new_free_block, size_t payload2merge) {
-    size_t orig_payloadsz = get_payload_size(new_free_block);  
-    size_t new_payloadsz = orig_payloadsz + payload2merge;
-    set_header(new_free_block, new_payloadsz, 0);
-}
-
-/* Given a pointer to a free block, continuously determines if its right neighbor is free,
- * and if so, merges them into a single free block.
- */
-void coalesce(header_t* new_free_block) {
-    size_t payload2merge = 0;
-    header_t* right_neighbor = next_header(new_free_block);
-    while (right_neighbor) {
-        if (!is_free(right_neighbor)) {
-            break;
-        }
-        payload2merge += (ALIGNMENT + get_payload_size(right_neighbor));
-        struct node* right_nnode = header2payload(right_neighbor);
-        detach_free_block(right_nnode);
-        nused -= ALIGNMENT;
-        right_neighbor = next_header(right_neighbor);;
-    }
-    if (payload2merge > 0) {
-        merge_blocks(new_free_block, payload2merge);
-    }
-}
-
 /* Given a pointer from a client to the payload of the memory they'd like to free, preforms the "free"
  * operation by freeing up the header, attempting to coalesce, and adding the new block 
  * back into the explicit list. 
@@ -291,21 +490,55 @@ void myfree(void *ptr) {
     }
     header_t *header = payload2header(ptr);
     size_t payloadsz = get_payload_size(header);
+    bool cold = hot_cold_placement && !(*header & HOT);
+    drop_hot(header);
     struct node* new_free_payload = ptr;
-    add_free_block(new_free_payload);
+    if (cold) {
+        append_free_block(new_free_payload);
+    } else {
+        add_free_block(new_free_payload);
+    }
     set_header(header, payloadsz, 0); 
     coalesce(header); 
     nused -= payloadsz;
 }
 
+/* Lets memory-tight clients opt out of (or back into) the geometric slack that myrealloc 
+ * reserves behind blocks that keep growing. Enabled by default. The cost: once a block has 
+ * grown at all, its next growth reserves as many bytes again as slack, which other requests
+ * only get when nothing else fits, and it stays reserved until the block is freed or shrunk.
+ */
+void set_realloc_slack(bool enabled) {
+    realloc_slack = enabled;
+}
+
+/* Given a pointer to an allocated payload, the bytes it needs, and the bytes remaining after them,
+ * splits off up to as many bytes again as a free block flagged as slack. find_first passes slack
+ * over, so it stays next to the payload for a later realloc to coalesce back in place. Anything
+ * past that goes back to the free list as an ordinary free block.
+ */
+void reserve_slack(void *payload, size_t needed, size_t remaining) {
+    size_t slack = ALIGNMENT + needed;
+    if (remaining >= slack + MINIMUM_BLOCK_SIZE) {
+        split_block(payload, needed + slack, remaining - slack);
+        remaining = slack;
+    }
+    split_block(payload, needed, remaining);
+    header_t *slack_header = (header_t *)((char *)payload + needed);
+    set_header(slack_header, remaining - ALIGNMENT, SLACK);
+}
+
 /* Performs an in-place reallocation, which memmoves the data, the splits the block if necessary,
- * and resets the size of the previous header. 
+ * and resets the size of the previous header. A block that keeps growing keeps its leftover as slack.
  */
-void realloc_inplace(size_t bytes2copy, void *old_ptr, size_t needed, size_t post_cs_size, header_t *old_header) {
+void realloc_inplace(size_t bytes2copy, void *old_ptr, size_t needed, size_t post_cs_size, header_t *old_header,
+                     bool regrowing) {
     memmove(old_ptr, old_ptr, bytes2copy);
     size_t remaining = post_cs_size - needed;
     if (big_enough(remaining)) {
         needed = post_cs_size;  
+    } else if (regrowing && realloc_slack) {
+        reserve_slack(old_ptr, needed, remaining);
     } else { 
         split_block(old_ptr, needed, remaining); 
     }
@@ -313,10 +546,35 @@ void realloc_inplace(size_t bytes2copy, void *old_ptr, size_t needed, size_t pos
     nused += needed;
 }
 
+/* Given the rounded up size of a block that is being grown for at least the second time, 
+ * mallocs it with as much tail slack again (geometric growth), then hands the slack back 
+ * as an adjacent free block. Returns NULL, without complaint, if the larger block doesn't fit.
+ */
+void *malloc_with_slack(size_t needed) {
+    size_t reserve = 2 * needed + ALIGNMENT;
+    if (reserve > MAX_REQUEST_SIZE || reserve + nused > segment_size) {
+        return NULL;
+    }
+    void *payload = mymalloc(reserve);
+    if (payload == NULL) {
+        return NULL;
+    }
+    header_t *header = payload2header(payload);
+    drop_hot(header);
+    size_t remaining = get_payload_size(header) - needed;
+    if (!big_enough(remaining)) {
+        reserve_slack(payload, needed, remaining);
+        set_header(header, needed, 1);
+        nused -= remaining;
+    }
+    return payload;
+}
+
 /* Given a pointer to the payload the client wants to reallocate, and the new size they're allocating to,
  * reallocates and returns a pointer to where the data resides after realloating. Begins by coalescing the
  * free blocks as much as possible, then attempts to reallocate in place if possible, otherwise
- * moves the data to a new memory location via a call to my malloc. 
+ * moves the data to a new memory location via a call to my malloc. A block that grows repeatedly
+ * is moved with geometric tail slack, so the total copy cost of an append-heavy buffer is amortized linear.
  */
 void *myrealloc(void *old_ptr, size_t new_size) {
     size_t needed = roundup(new_size, ALIGNMENT);
@@ -330,21 +588,37 @@ void *myrealloc(void *old_ptr, size_t new_size) {
     }
     header_t* old_header = payload2header(old_ptr);
     size_t old_size = get_payload_size(old_header);
+    bool growing = (needed > old_size);
+    bool regrowing = growing && (*old_header & GROWN);
+    drop_hot(old_header);   // A reallocated block no longer counts as hot
     coalesce(old_header);
     size_t post_cs_size = get_payload_size(old_header); 
+    nused += post_cs_size - old_size;   // The block now owns whatever it coalesced
 
     if (needed <= post_cs_size) {   // Treats shrinking and growing in-place the same
         size_t bytes2copy = (old_size < new_size) ? old_size : new_size; 
-        realloc_inplace(bytes2copy, old_ptr, needed, post_cs_size, old_header);
+        nused -= post_cs_size;
+        realloc_inplace(bytes2copy, old_ptr, needed, post_cs_size, old_header, regrowing);
+        if (growing) {
+            set_header(old_header, get_payload_size(old_header), 1 | GROWN);
+        }
         return old_ptr;
     } else {
-        void *new_ptr = mymalloc(new_size);   // There wasn't enough space, even after coalescing
+        void *new_ptr = NULL;   // There wasn't enough space, even after coalescing
+        if (regrowing && realloc_slack) {
+            new_ptr = malloc_with_slack(needed);
+        }
+        if (new_ptr == NULL) {
+            new_ptr = mymalloc(new_size);
+        }
         if (new_ptr == NULL) {
             return NULL;
         } 
-        memcpy(new_ptr, old_ptr, new_size); 
+        memcpy(new_ptr, old_ptr, old_size); 
         myfree(old_ptr); 
-        nused += needed;
+        header_t *new_header = payload2header(new_ptr);
+        drop_hot(new_header);
+        set_header(new_header, get_payload_size(new_header), 1 | GROWN);
         return new_ptr;
     }
 }
@@ -360,7 +634,7 @@ bool validate_heap() {
     int free_list_size = 0;
     int num_free_blocks = 0;
     
-    header_t *header = payload2header(fl_front);
+    header_t *header = fl_front ? payload2header(fl_front) : NULL;
     while (header != NULL) {
         if (!is_free(header)) {
             printf(" >:( What are you doing in my explicit list\n");
@@ -368,10 +642,16 @@ bool validate_heap() {
             return false;
         }
         free_list_size++;
+        if (!next_free(header) && header != payload2header(fl_back)) {
+            printf("The back of my explicit list wandered off\n");
+            breakpoint();
+            return false;
+        }
         header = next_free(header);
     }
     header = segment_start;
     size_t live_count = 0;
+    size_t hot_bytes = 0;
     while (header) { 
         size_t this_size = get_payload_size(header);
         if (this_size % ALIGNMENT != 0) {
@@ -387,6 +667,8 @@ bool validate_heap() {
         num_blocks++;
         if (is_free(header)) {
             num_free_blocks++;
+        } else if (*header & HOT) {
+            hot_bytes += this_size;
         }
         live_count += ALIGNMENT + this_size;
         header = next_header(header);
@@ -396,6 +678,15 @@ bool validate_heap() {
         breakpoint();
         return false;
     }
+    size_t region_total = 0;
+    for (int i = 0; i < MAX_REGIONS; i++) {
+        region_total += region_hot[i];
+    }
+    if (region_total != hot_bytes) {
+        printf("Hot region bytes are off: Counted: %ld Hot: %ld \n", region_total, hot_bytes);
+        breakpoint();
+        return false;
+    }
     if (num_free_blocks < free_list_size) {
         printf("You might be listing extra blocks in your free list?\n"); 
         breakpoint();
@@ -423,7 +714,7 @@ void dump_heap() {
         size_t this_size = get_payload_size(header);
         char str_ex[BYTES_PER_LINE * 2]; 
         if (is_free(header)) {
-            status_str = 'F';
+            status_str = is_slack(header) ? 'S' : 'F';
             header_t* next_f = next_free(header);
             header_t* prev_f = prev_free(header);
             sprintf(str_ex, "P: %p, N: %p", next_f, prev_f);
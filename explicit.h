@@ -0,0 +1,27 @@
+/* Katherine Worden | CS107 | Assignment 6
+ * Extra entry points the explicit allocator offers on top of the ones declared in allocator.h.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Turns the geometric slack that myrealloc reserves behind repeatedly grown blocks
+ * on or off. Enabled by default; memory-tight clients can switch it off.
+ */
+void set_realloc_slack(bool enabled);
+
+/* Turns hot/cold placement on or off. When on, small, frequently reused size classes are packed
+ * into the 2 MiB regions of the heap that already hold the most of them, and large or rarely used
+ * blocks are placed in the regions that hold the fewest. Off by default.
+ */
+void set_hot_cold_placement(bool enabled);
+
+/* Maps a heap segment of at least heap_size bytes, aligned to 2 MiB and advised to be backed by
+ * transparent huge pages, for handing to myinit. Returns NULL on failure.
+ */
+void *hugepage_segment(size_t heap_size);
+
+// Unmaps a segment from hugepage_segment, given the heap size it was requested with
+void release_hugepage_segment(void *segment, size_t heap_size);
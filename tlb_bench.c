@@ -0,0 +1,153 @@
+/* Katherine Worden | CS107 | Assignment 6
+ * A standalone benchmark for the explicit allocator's huge page options. It builds a heap of small,
+ * hot list nodes interleaved with large, cold blocks, then chases the list in a shuffled order and
+ * reports dTLB load misses (read through perf_event_open) for each combination of 4 KiB or
+ * transparent huge pages and hot/cold placement on or off. Build it next to explicit.c:
+ *     gcc -O2 -std=gnu99 tlb_bench.c explicit.c -o tlb_bench
+ */
+
+#include "./allocator.h"
+#include "./explicit.h"
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HEAP_SIZE (256UL << 20)
+#define NUM_NODES 32768
+#define COLD_SIZE 6000
+#define ROUNDS 32
+
+struct bench_node {
+    struct bench_node *next;
+    size_t payload[5];
+};
+
+struct bench_node *nodes[NUM_NODES];
+
+// Opens a counter of this thread's user-space dTLB load misses, returning -1 if the kernel or CPU won't give us one
+int open_dtlb_counter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Given the start of a mapping, returns how many KiB of it the kernel has backed with
+ * transparent huge pages, according to /proc/self/smaps, or 0 if it can't tell.
+ */
+size_t huge_kib(void *segment) {
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    if (smaps == NULL) {
+        return 0;
+    }
+    char line[256];
+    bool in_segment = false;
+    size_t kib = 0;
+    while (fgets(line, sizeof(line), smaps)) {
+        unsigned long start, end;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            in_segment = (start <= (unsigned long)segment && (unsigned long)segment < end);
+        } else if (in_segment && sscanf(line, "AnonHugePages: %zu kB", &kib) == 1) {
+            break;
+        }
+    }
+    fclose(smaps);
+    return kib;
+}
+
+/* Given a segment to use as the heap and whether to turn on hot/cold placement, allocates the
+ * hot nodes interleaved with cold blocks, links the nodes into one shuffled cycle, and chases it
+ * ROUNDS times while counting dTLB load misses. Prints one line of results.
+ */
+void run_bench(const char *name, void *segment, bool hot_cold) {
+    if (segment == NULL || !myinit(segment, HEAP_SIZE)) {
+        printf("%-26s could not set up the heap\n", name);
+        return;
+    }
+    set_hot_cold_placement(hot_cold);
+    for (int i = 0; i < NUM_NODES; i++) {
+        nodes[i] = mymalloc(sizeof(struct bench_node));
+        void *cold = mymalloc(COLD_SIZE);   // Long-lived and never read again
+        if (nodes[i] == NULL || cold == NULL) {
+            printf("%-26s ran out of heap\n", name);
+            return;
+        }
+        memset(cold, 0, COLD_SIZE);
+    }
+    unsigned long seed = 107;
+    for (int i = NUM_NODES - 1; i > 0; i--) {   // Fisher-Yates, so the chase defeats the prefetcher
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        int j = (seed >> 33) % (i + 1);
+        struct bench_node *tmp = nodes[i];
+        nodes[i] = nodes[j];
+        nodes[j] = tmp;
+    }
+    for (int i = 0; i < NUM_NODES; i++) {
+        nodes[i]->next = nodes[(i + 1) % NUM_NODES];
+    }
+
+    int fd = open_dtlb_counter();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    struct bench_node *cur = nodes[0];
+    for (long step = 0; step < (long)NUM_NODES * ROUNDS; step++) {
+        cur = cur->next;
+    }
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    char misses[32] = "unavailable";
+    unsigned long long count;
+    if (fd >= 0 && read(fd, &count, sizeof(count)) == sizeof(count)) {
+        sprintf(misses, "%llu", count);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    printf("%-26s dTLB-load-misses: %-12s %8.1f ms  THP: %zu KiB  (end %p)\n",
+           name, misses, ms, huge_kib(segment), (void *)cur);
+}
+
+// Maps a heap segment the ordinary way and asks the kernel to keep it on 4 KiB pages
+void *small_page_segment() {
+    void *segment = mmap(NULL, HEAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (segment == MAP_FAILED) {
+        return NULL;
+    }
+#ifdef MADV_NOHUGEPAGE
+    madvise(segment, HEAP_SIZE, MADV_NOHUGEPAGE);
+#endif
+    return segment;
+}
+
+int main() {
+    for (int hot_cold = 0; hot_cold <= 1; hot_cold++) {
+        void *segment = small_page_segment();
+        run_bench(hot_cold ? "4 KiB pages, hot/cold" : "4 KiB pages", segment, hot_cold);
+        if (segment != NULL) {
+            munmap(segment, HEAP_SIZE);
+        }
+        segment = hugepage_segment(HEAP_SIZE);
+        run_bench(hot_cold ? "huge pages, hot/cold" : "huge pages", segment, hot_cold);
+        release_hugepage_segment(segment, HEAP_SIZE);
+    }
+    return 0;
+}